@@ -44,6 +44,10 @@ namespace ListsViaTypes {
 		template<size_t N>
 		using type_of_index = std::tuple_element_t<N, as_tuple>;
 
+		static constexpr size_t size() {
+			return sizeof...(Types);
+		}
+
 		template<typename T>
 		static constexpr size_t get_index_of() {
 			return Indexer<T, Types...>::value;
@@ -59,6 +63,16 @@ namespace ListsViaTypes {
 			return (contains<Ts>() && ...);
 		}
 
+		template<typename ...Ts>
+		static constexpr bool contains_any() {
+			return (contains<Ts>() || ...);
+		}
+
+		template<typename ...Ts>
+		static constexpr bool contains_none() {
+			return !contains_any<Ts...>();
+		}
+
 
 	};
 
@@ -141,6 +155,24 @@ namespace ListsViaTypes {
 	using PowersetOf = RemoveRepeats<typename PowersetComputer<List>::type>;	
 
 
+	template<typename List, template<typename> typename Predicate>
+	struct Filterer;
+
+	template<template<typename> typename Predicate>
+	struct Filterer<TypeList<>, Predicate> {
+		using type = TypeList<>;
+	};
+
+	template<typename T, typename ... Ts, template<typename> typename Predicate>
+	struct Filterer<TypeList<T, Ts...>, Predicate> {
+		using Rest = typename Filterer<TypeList<Ts...>, Predicate>::type;
+
+		using type = std::conditional_t<Predicate<T>::value, typename Rest::template prepend<T>, Rest>;
+	};
+
+	template<typename List, template<typename> typename Predicate>
+	using Filter = typename Filterer<List, Predicate>::type;
+
 	template<typename List1, typename List2>
 	struct ContainsAllHelper {
 		constexpr static bool value = false;
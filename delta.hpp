@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+namespace jl {
+
+    // Binary encoding of a component for ECS::write_delta() and ECS::apply_delta().
+    // Trivially copyable components are written as raw bytes. Any other component type needs a
+    // specialization with the same two static functions.
+    template<class T>
+    struct serializer {
+        static_assert(std::is_trivially_copyable_v<T>, "jl::serializer<T> must be specialized for components which are not trivially copyable.");
+
+        static void write(std::ostream & out, T const & t) {
+            out.write(reinterpret_cast<char const *>(std::addressof(t)), sizeof(T));
+        }
+
+        static void read(std::istream & in, T & t) {
+            in.read(reinterpret_cast<char *>(std::addressof(t)), sizeof(T));
+        }
+    };
+
+    inline void write_varint(std::ostream & out, std::uint64_t value) {
+        while (value >= 0x80u) {
+            out.put(static_cast<char>((value & 0x7Fu) | 0x80u));
+            value >>= 7;
+        }
+        out.put(static_cast<char>(value));
+    }
+
+    inline std::uint64_t read_varint(std::istream & in) {
+        std::uint64_t value = 0;
+
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            auto byte = in.get();
+            if (byte == std::istream::traits_type::eof()) {
+                throw std::runtime_error("jl::read_varint() reached the end of the stream.");
+            }
+
+            value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+
+        throw std::runtime_error("jl::read_varint() read an overlong varint.");
+    }
+
+    template<class Char, class Traits, class Allocator>
+    struct serializer<std::basic_string<Char, Traits, Allocator>> {
+        using string_type = std::basic_string<Char, Traits, Allocator>;
+
+        static void write(std::ostream & out, string_type const & s) {
+            write_varint(out, s.size());
+            out.write(reinterpret_cast<char const *>(s.data()), s.size() * sizeof(Char));
+        }
+
+        static void read(std::istream & in, string_type & s) {
+            s.resize(read_varint(in));
+            in.read(reinterpret_cast<char *>(s.data()), s.size() * sizeof(Char));
+        }
+    };
+}
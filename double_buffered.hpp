@@ -0,0 +1,142 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+namespace jl {
+
+    // Opt-in component policy for data read by other threads while the simulation writes it.
+    // Register DoubleBuffered<Position> in the ECS type list instead of Position.
+    //
+    // Envisioned use
+    // simulation thread:
+    //     auto frame = ecs.published_frame();
+    //     e->get_component<DoubleBuffered<Position>>().write(frame) += velocity;
+    //     ecs.publish_frame();
+    // render thread:
+    //     auto pin = ecs.pin_frame();
+    //     draw(e->get_component<DoubleBuffered<Position>>().read(pin.frame()));
+    //
+    // read(frame) and write(frame) never touch the same slot. Readers never block; publishing
+    // waits for readers still pinned to the slot that becomes the next back buffer.
+    template<class T>
+    struct DoubleBuffered {
+        using value_type = T;
+
+        DoubleBuffered() = default;
+
+        DoubleBuffered(T const & t) : buffers{ t, t } { }
+
+        T const & read(size_t frame) const noexcept {
+            return buffers[frame & 1u];
+        }
+
+        T & write(size_t frame) noexcept {
+            return buffers[(frame + 1u) & 1u];
+        }
+
+        void carry_forward(size_t frame) {
+            write(frame) = read(frame);
+        }
+
+    private:
+        T buffers[2]{};
+    };
+
+    // Frame counter shared by the writer and the readers of DoubleBuffered components. A reader
+    // pins the published frame for as long as it reads, and advance() does not return while any
+    // reader is still pinned to the slot the writer is about to reuse.
+    class frame_clock {
+    public:
+        class pin {
+        public:
+            pin(pin && other) noexcept : readers(std::exchange(other.readers, nullptr)), pinned(other.pinned) { }
+
+            pin & operator=(pin && other) noexcept {
+                if (this != &other) {
+                    release();
+                    readers = std::exchange(other.readers, nullptr);
+                    pinned = other.pinned;
+                }
+                return *this;
+            }
+
+            ~pin() {
+                release();
+            }
+
+            size_t frame() const noexcept {
+                return pinned;
+            }
+
+        private:
+            friend class frame_clock;
+
+            pin(std::atomic<size_t> * r, size_t f) noexcept : readers(r), pinned(f) { }
+
+            void release() noexcept {
+                if (readers != nullptr) {
+                    frame_clock::unpin(*readers);
+                    readers = nullptr;
+                }
+            }
+
+            std::atomic<size_t> * readers;
+            size_t pinned;
+        };
+
+        // For reader threads. The count is raised before the frame is checked again, so advance()
+        // either sees this reader or this reader sees the new frame and retries.
+        pin pin_frame() noexcept {
+            for (;;) {
+                size_t f = frame.load();
+                auto & count = readers[f & 1u];
+                count.fetch_add(1);
+
+                if (frame.load() == f) {
+                    return pin(&count, f);
+                }
+
+                unpin(count);
+            }
+        }
+
+        // For the writing thread only.
+        size_t current() const noexcept {
+            return frame.load(std::memory_order_relaxed);
+        }
+
+        size_t advance() {
+            size_t published = frame.fetch_add(1) + 1;
+
+            auto & stale = readers[(published + 1u) & 1u];
+            for (size_t n = stale.load(); n != 0; n = stale.load()) {
+                stale.wait(n);
+            }
+
+            return published;
+        }
+
+    private:
+        static void unpin(std::atomic<size_t> & count) noexcept {
+            if (count.fetch_sub(1) == 1) {
+                count.notify_all();
+            }
+        }
+
+        std::atomic<size_t> frame{ 0 };
+        std::array<std::atomic<size_t>, 2> readers{};
+    };
+
+    template<class T>
+    struct is_double_buffered : std::false_type { };
+
+    template<class T>
+    struct is_double_buffered<DoubleBuffered<T>> : std::true_type { };
+
+    template<class T>
+    inline constexpr bool is_double_buffered_v = is_double_buffered<T>::value;
+}
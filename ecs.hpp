@@ -3,8 +3,22 @@
 
 #include "TypeList.hpp"
 #include "concepts.hpp"
+#include "delta.hpp"
+#include "double_buffered.hpp"
+#include "query.hpp"
+#include "scheduler.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
 
 template<template<class...> class ArchetypeContainerModel, template<class...> class ComponentContainerModel, class ListOfTypes>
 struct ECS {
@@ -28,12 +42,13 @@ struct ECS {
 		using pointer_types = held_components::template apply_to_each<std::add_pointer_t>;
 		using const_pointer_types = held_components::template apply_to_each<std::add_const_t>::template apply_to_each<std::add_pointer_t>;
 
+		size_t id = 0;
 		pointer_types::as_tuple pointers_to_components;
 
 		template<class R>
 		auto set_component(R * r) {
 			static_assert(held_components::template contains<R>(), "get_component() called with template parameter not in the archetype of the entity.");
-			constexpr size_t index = typename held_components::template get_index_of<R>();
+			constexpr size_t index = held_components::template get_index_of<R>();
 			using ptr_to_R_t = typename pointer_types::template type_of_index<index>;
 			std::get<ptr_to_R_t>(pointers_to_components) = r;
 			return r;
@@ -43,7 +58,7 @@ struct ECS {
 		template<class R>
 		auto get_component() -> R & {
 			static_assert(held_components::template contains<R>(), "get_component() called with template parameter not in the archetype of the entity.");
-			constexpr size_t index = typename held_components::template get_index_of<R>();
+			constexpr size_t index = held_components::template get_index_of<R>();
 			using ptr_to_R_t = typename pointer_types::template type_of_index<index>;
 			auto ptr = std::get<ptr_to_R_t>(pointers_to_components);
 			return *ptr;
@@ -53,16 +68,76 @@ struct ECS {
 		auto get_component() const  -> R const & {
 			static_assert(held_components::template contains<R>(), "get_component() called with template parameter not in the archetype of the entity.");
 
-			constexpr size_t index = typename held_components::template index_of_type<R>();
-			using const_itr_to_R = typename const_iterator_types::template type_of_index<index>;
+			constexpr size_t index = held_components::template get_index_of<R>();
 			using cptr_to_R_t = typename pointer_types::template type_of_index<index>;
 			auto cptr = std::get<cptr_to_R_t>(pointers_to_components);
 			return *cptr;
 		}
+
+		// Returns nullptr when the archetype does not hold R. Whether it does is known at compile time.
+		template<class R>
+		auto try_get_component() -> R * {
+			if constexpr (held_components::template contains<R>()) {
+				return &get_component<R>();
+			}
+			else {
+				return nullptr;
+			}
+		}
+
+		template<class R>
+		auto try_get_component() const -> R const * {
+			if constexpr (held_components::template contains<R>()) {
+				return &get_component<R>();
+			}
+			else {
+				return nullptr;
+			}
+		}
 	};
 
 	using Archetypes = ArchetypeTypeList::template apply_to_each<entity>;
 
+	// Pending add and remove notifications of one archetype, delivered by flush_events().
+	template<class TypeList>
+	struct archetype_events;
+
+	template<class ... HeldComponents>
+	struct archetype_events<ListsViaTypes::TypeList<HeldComponents...>> {
+		using entity_type = entity<ListsViaTypes::TypeList<HeldComponents...>>;
+		using batch = std::span<entity_type * const>;
+		using observer = std::function<void(batch)>;
+
+		bool observed() const noexcept {
+			return !on_added.empty() || !on_removed.empty();
+		}
+
+		std::vector<observer> on_added;
+		std::vector<observer> on_removed;
+
+		std::vector<entity_type *> added;
+		std::vector<entity_type *> removed;
+		// Removed entities stay alive here until their on_removed observers have seen them.
+		std::vector<typename ArchetypeContainerModel<entity_type>::element_pointer> graveyard;
+
+		// Swapped with the vectors above while a batch is delivered, so observers may create and
+		// destroy entities, and so both sets of buffers keep their capacity across frames.
+		std::vector<entity_type *> added_in_flight;
+		std::vector<entity_type *> removed_in_flight;
+		std::vector<typename ArchetypeContainerModel<entity_type>::element_pointer> graveyard_in_flight;
+	};
+
+	// A prefab is a copy of every component of one archetype, used as a template for spawning.
+	template<class TypeList>
+	struct prefab;
+
+	template<class ... HeldComponents>
+	struct prefab<ListsViaTypes::TypeList<HeldComponents...>> {
+		using held_components = ListsViaTypes::TypeList<HeldComponents...>;
+
+		std::tuple<HeldComponents...> components;
+	};
+
 	template<class List>
 	auto& get_storage_for_archetypes() {
 		return std::get<ArchetypeContainerModel<entity<List>>>(archetype_storage);
@@ -71,7 +146,7 @@ struct ECS {
 	template<class ... Ts>
 	auto& get_storage_for_archetype_with_components() {
 		static_assert(ListOfTypes::template contains_all<Ts...>(), "get_storage_for_archetype_with_components() called on list of types containing at least one type not in the ECS type list.");
-		return std::get<ArchetypeContainerModel<entity<TypeList<Ts...>>>>(archetype_storage);
+		return std::get<ArchetypeContainerModel<entity<ListsViaTypes::TypeList<Ts...>>>>(archetype_storage);
 	}
 
 	template<class List, class Functional>
@@ -85,8 +160,23 @@ struct ECS {
 	template<class List, class Functional>
 	void for_each_entity_with_components(Functional const & f) {
 		auto wrapped = [this, &f]<class R>() mutable -> void {
-			if constexpr (ListsViaTypes::ContainsAll<R::held_components, List>) {
-				this->apply_to_entities_of_archetype<R::held_components>(f);
+			if constexpr (ListsViaTypes::ContainsAll<typename R::held_components, List>) {
+				this->template apply_to_entities_of_archetype<typename R::held_components>(f);
+			}
+		};
+
+		Archetypes::template call_on_each_type(wrapped);
+	}
+
+	// Terms are jl::query::With, Without, AnyOf and Optional. Archetypes which fail any term are
+	// pruned at compile time.
+	template<class ... Terms, class Functional>
+	void for_each_entity_matching(Functional const & f) {
+		using Query = jl::query::Query<Terms...>;
+
+		auto wrapped = [this, &f]<class R>() mutable -> void {
+			if constexpr (Query::template matches<typename R::held_components>()) {
+				this->template apply_to_entities_of_archetype<typename R::held_components>(f);
 			}
 		};
 
@@ -94,23 +184,688 @@ struct ECS {
 	}
 
 
+	// Runs several systems made with jl::query::make_system() in a single traversal of each
+	// archetype, instead of one traversal per system. Archetypes matched by none of them are pruned
+	// at compile time, and each entity is only handed to the systems whose query it matches.
+	// On every entity the systems run in argument order, so a system sees what earlier ones wrote
+	// to that entity. Systems which read or write other entities than the one they are given
+	// must not be fused.
+	//
+	// Envisioned use
+	// ecs.fused(make_system<With<Position, Velocity>>(move),
+	//           make_system<With<Position>>(clamp),
+	//           make_system<With<Age>, Without<Dead>>(age));
+	template<class ... Systems>
+	void fused(Systems const & ... systems) {
+		auto wrapped = [this, &systems...]<class R>() mutable -> void {
+			using Held = typename R::held_components;
+
+			if constexpr ((Systems::query::template matches<Held>() || ...)) {
+				for (auto & up : this->template get_storage_for_archetypes<Held>()) {
+					auto * e = up.get();
+					(run_if_matching<Held>(systems, e), ...);
+				}
+			}
+		};
+
+		Archetypes::template call_on_each_type(wrapped);
+	}
+
+	template<class Query>
+	struct matches_query {
+		template<class R>
+		using predicate = std::bool_constant<Query::template matches<typename R::held_components>()>;
+	};
+
+	template<class ... Terms>
+	using ArchetypesMatching = ListsViaTypes::Filter<Archetypes, matches_query<jl::query::Query<Terms...>>::template predicate>;
+
+	// Like for_each_entity_matching(), but as a coroutine which yields to the scheduler whenever the
+	// frame budget is spent, and picks up at the same archetype and row next frame.
+	// The cursor is a row index, so entities created, destroyed or sorted between frames may shift
+	// which rows are left to visit in the archetype being traversed.
+	template<class ... Terms, class Functional>
+	jl::system_task for_each_entity_matching_budgeted(jl::frame_scheduler & scheduler, Functional f) {
+		return budgeted_pass(scheduler, std::move(f), ArchetypesMatching<Terms...>{});
+	}
+
 	template<class ... ComponentTypes>
 	auto create_entity() -> entity<ListsViaTypes::TypeList<ComponentTypes...>> * {
 		static_assert(ListOfTypes::template contains_all<ComponentTypes...>(),
 			"create_entity() called with first template parameter which is a TypeList but which contains types not in the TypeList expected by the ECS class.");
 
+		return spawn<ComponentTypes...>(++last_id);
+	}
+
+	// The entity disappears from its archetype at once. If the archetype is observed, its memory is
+	// only released by the next flush_events(), so the handles in the batches stay valid.
+	template<class ... HeldComponents>
+	void destroy_entity(entity<ListsViaTypes::TypeList<HeldComponents...>> * e) {
+		using EntityType = entity<ListsViaTypes::TypeList<HeldComponents...>>;
+
+		auto & pending = std::get<archetype_events<ListsViaTypes::TypeList<HeldComponents...>>>(events);
+		if (pending.observed()) {
+			pending.removed.push_back(e);
+			pending.graveyard.push_back(std::get<ArchetypeContainerModel<EntityType>>(archetype_storage).release(e));
+			return;
+		}
+
+		(std::get<ComponentContainerModel<HeldComponents>>(component_storage).remove(&e->template get_component<HeldComponents>()), ...);
+		std::get<ArchetypeContainerModel<EntityType>>(archetype_storage).remove(e);
+	}
+
+	// Like destroy_entity() for every entity of the batch, but with one pass over the archetype
+	// and over each component container instead of one removal per entity.
+	template<class ... HeldComponents>
+	void destroy_entities(std::vector<entity<ListsViaTypes::TypeList<HeldComponents...>> *> batch) {
+		using EntityType = entity<ListsViaTypes::TypeList<HeldComponents...>>;
+
+		auto & rows = std::get<ArchetypeContainerModel<EntityType>>(archetype_storage);
+
+		auto & pending = std::get<archetype_events<ListsViaTypes::TypeList<HeldComponents...>>>(events);
+		if (pending.observed()) {
+			pending.removed.insert(pending.removed.end(), batch.begin(), batch.end());
+			auto released = rows.release_all(std::move(batch));
+			pending.graveyard.insert(pending.graveyard.end(), std::make_move_iterator(released.begin()), std::make_move_iterator(released.end()));
+			return;
+		}
+
+		[[maybe_unused]] auto release_components = [this, &batch]<class C>() mutable -> void {
+			std::vector<C *> dead;
+			dead.reserve(batch.size());
+			for (auto * e : batch) {
+				dead.push_back(&e->template get_component<C>());
+			}
+
+			std::get<ComponentContainerModel<C>>(component_storage).remove_all(std::move(dead));
+		};
+
+		(release_components.template operator()<HeldComponents>(), ...);
+
+		rows.remove_all(std::move(batch));
+	}
+
+	// Observers receive one batch per archetype holding T, as a std::span of entity handles, when
+	// flush_events() is called. They are not called per entity, and entities which existed before
+	// the observer was registered are not reported.
+	//
+	// Envisioned use
+	// ecs.on_added<RigidBody>([&](auto batch) {
+	//     for (auto * e : batch) physics.add_body(e->template get_component<RigidBody>());
+	// });
+	// every frame: ... ecs.flush_events();
+	template<class T, class Functional>
+	void on_added(Functional f) {
+		add_observer<T>(f, [](auto & pending) -> auto & { return pending.on_added; });
+	}
+
+	template<class T, class Functional>
+	void on_removed(Functional f) {
+		add_observer<T>(f, [](auto & pending) -> auto & { return pending.on_removed; });
+	}
+
+	// Sync point. Delivers the pending batches, then releases the entities destroyed since the
+	// last flush. Components of each archetype are released in one pass per component type.
+	void flush_events() {
+		auto flush = [this]<class List>() mutable -> void {
+			this->flush_archetype_events(List{});
+		};
+
+		ArchetypeTypeList::template call_on_each_type(flush);
+	}
+
+	template<class ... HeldComponents>
+	static auto make_prefab(entity<ListsViaTypes::TypeList<HeldComponents...>> const * e) -> prefab<ListsViaTypes::TypeList<HeldComponents...>> {
+		return { std::tuple<HeldComponents...>(e->template get_component<HeldComponents>()...) };
+	}
+
+	// Spawns count copies of the prefab. Each archetype and component container is filled with one
+	// bulk copy instead of count separate insertions.
+	template<class ... HeldComponents>
+	auto instantiate(prefab<ListsViaTypes::TypeList<HeldComponents...>> const & p, size_t count) -> std::vector<entity<ListsViaTypes::TypeList<HeldComponents...>> *> {
+		using EntityType = entity<ListsViaTypes::TypeList<HeldComponents...>>;
+
+		ArchetypeContainerModel<EntityType> & this_archetype = std::get<ArchetypeContainerModel<EntityType>>(archetype_storage);
+
+		auto instances = this_archetype.create_copies(EntityType{}, count);
+
+		for (auto * instance : instances) {
+			instance->id = ++last_id;
+		}
+
+		if (auto & pending = std::get<archetype_events<ListsViaTypes::TypeList<HeldComponents...>>>(events); pending.observed()) {
+			pending.added.insert(pending.added.end(), instances.begin(), instances.end());
+		}
+
+		auto clone_component = [this, &p, &instances]<class C>() mutable -> void {
+			auto copies = std::get<ComponentContainerModel<C>>(component_storage).create_copies(std::get<C>(p.components), instances.size());
+
+			for (size_t i = 0; i < instances.size(); ++i) {
+				instances[i]->template set_component<C>(copies[i]);
+			}
+		};
+
+		(clone_component.template operator()<HeldComponents>(), ...);
+
+		return instances;
+	}
+
+	template<class ... HeldComponents>
+	auto clone_entity(entity<ListsViaTypes::TypeList<HeldComponents...>> const * e, size_t count) -> std::vector<entity<ListsViaTypes::TypeList<HeldComponents...>> *> {
+		return instantiate(make_prefab(e), count);
+	}
+
+	// Column-wise copy of one archetype, ordered by entity id.
+	template<class TypeList>
+	struct archetype_snapshot;
+
+	template<class ... HeldComponents>
+	struct archetype_snapshot<ListsViaTypes::TypeList<HeldComponents...>> {
+		std::vector<size_t> ids;
+		std::tuple<std::vector<HeldComponents>...> columns;
+	};
+
+	using snapshot = ArchetypeTypeList::template apply_to_each<archetype_snapshot>::as_tuple;
+
+	// Envisioned use
+	// server, every tick:
+	//     auto current = ecs.take_snapshot();
+	//     myECS::write_delta(previous, current, pipe);
+	//     previous = std::move(current);
+	// replica:
+	//     replica.apply_delta(pipe);
+	//
+	// Components must be equality comparable and have a jl::serializer. Components are written
+	// through plain references, so nothing records which archetypes changed: every snapshot copies
+	// every row, and write_delta() compares every row of both snapshots.
+	snapshot take_snapshot() const {
+		snapshot s;
+
+		auto capture = [this, &s]<class List>() mutable -> void {
+			this->capture_archetype(std::get<archetype_snapshot<List>>(s));
+		};
+
+		ArchetypeTypeList::template call_on_each_type(capture);
+
+		return s;
+	}
+
+	// Stream format, repeated for each archetype with at least one difference:
+	// archetype index + 1, then spawned rows (id, every component), despawned ids, and changed rows
+	// (id, bit mask of changed components, the changed components). A zero ends the delta.
+	// Ids are written as the gap from the previous id, and every integer is a LEB128 varint.
+	static void write_delta(snapshot const & from, snapshot const & to, std::ostream & out) {
+		size_t archetype_tag = 0;
+
+		auto write_archetype = [&from, &to, &out, &archetype_tag]<class List>() mutable -> void {
+			++archetype_tag;
+			write_archetype_delta(archetype_tag, std::get<archetype_snapshot<List>>(from), std::get<archetype_snapshot<List>>(to), out);
+		};
+
+		ArchetypeTypeList::template call_on_each_type(write_archetype);
+
+		jl::write_varint(out, 0);
+	}
+
+	// Spawned entities keep the ids of the writer, so a replica should not also create_entity() itself.
+	void apply_delta(std::istream & in) {
+		for (auto archetype_tag = jl::read_varint(in); archetype_tag != 0; archetype_tag = jl::read_varint(in)) {
+			size_t index = 0;
+			bool applied = false;
+
+			auto apply_archetype = [this, &in, &index, &applied, archetype_tag]<class List>() mutable -> void {
+				if (++index == archetype_tag) {
+					this->apply_archetype_delta(List{}, in);
+					applied = true;
+				}
+			};
+
+			ArchetypeTypeList::template call_on_each_type(apply_archetype);
+
+			if (!applied) {
+				throw std::runtime_error("ECS::apply_delta() read an archetype index which this ECS does not have.");
+			}
+		}
+	}
+
+	// Runtime component ids are the positions in ListOfTypes, so a component_mask has bit
+	// component_id<T>() set for each T it names. Scripts can build masks from ids alone.
+	using component_mask = std::uint64_t;
+	static_assert(ListOfTypes::size() <= 64, "ECS component_mask holds at most 64 component types.");
+
+	template<class T>
+	static constexpr size_t component_id() {
+		return ListOfTypes::template get_index_of<T>();
+	}
+
+	template<class ... Ts>
+	static constexpr component_mask mask_of() {
+		return ((component_mask{ 1 } << component_id<Ts>()) | ... | component_mask{ 0 });
+	}
+
+	// Visits every entity whose archetype holds all of include and none of exclude. The callback
+	// receives one pointer per component id, nullptr for components the archetype lacks.
+	// The list of matching archetypes is computed once per (include, exclude) pair and cached.
+	//
+	// Envisioned use
+	// ecs.query(mask_from_script, 0, [&](std::span<void * const> row) {
+	//     auto * position = static_cast<Position *>(row[position_id]);
+	// });
+	template<class Functional>
+	void query(component_mask include, component_mask exclude, Functional && f) {
+		dynamic_callback callback{ std::addressof(f), [](void const * context, std::span<void * const> row) {
+			// Casts back to the callable's own type, so a const callable stays const.
+			(*static_cast<std::remove_reference_t<Functional> *>(const_cast<void *>(context)))(row);
+		} };
+
+		static constexpr auto visitors = make_dynamic_visitors(ArchetypeTypeList{});
+
+		for (auto archetype : matching_archetypes(include, exclude)) {
+			visitors[archetype](*this, callback);
+		}
+	}
+
+	// Reorders the rows of one archetype by key_of(entity const &), for example a Morton code of its
+	// position, so that queries visit nearby entities together. Entity handles stay valid.
+	// Re-sorting every frame is cheap when entities have moved only a little.
+	//
+	// Envisioned use
+	// ecs.sort_archetype<TypeList<Position, Velocity>>([](auto const & e) {
+	//     return morton_code(e.template get_component<Position>());
+	// });
+	template<class List, class KeyFunction>
+	void sort_archetype(KeyFunction key_of) {
+		get_storage_for_archetypes<List>().sort_by(key_of);
+	}
+
+	// Reallocates the components of one archetype in its current row order. Each component still
+	// gets its own allocation, so whether they end up adjacent in memory is up to the allocator.
+	// Costs one allocation per component, so it is meant to run occasionally rather than every frame.
+	template<class List>
+	void compact_archetype() {
+		compact_rows(List{});
+	}
+
+	// Frame number for the writing thread to pass to DoubleBuffered<T>::write().
+	size_t published_frame() const noexcept {
+		return clock.current();
+	}
+
+	// For reader threads. Pass pin.frame() to DoubleBuffered<T>::read() and keep the pin alive
+	// while reading. Only component values are double buffered; creating entities still excludes readers.
+	jl::frame_clock::pin pin_frame() noexcept {
+		return clock.pin_frame();
+	}
+
+	// Called by the writing thread after every write for the frame. The back buffers become the
+	// front, and once no reader is pinned to the old front it is refreshed from the new one, so
+	// writers start from the latest state.
+	void publish_frame() {
+		size_t published = clock.advance();
+
+		auto carry_forward = [this, published]<class C>() mutable -> void {
+			if constexpr (jl::is_double_buffered_v<C>) {
+				for (auto & up : std::get<ComponentContainerModel<C>>(component_storage)) {
+					up->carry_forward(published);
+				}
+			}
+		};
+
+		ListOfTypes::template call_on_each_type(carry_forward);
+	}
+
+private:
+	template<class Held, class System, class Entity>
+	static void run_if_matching(System const & system, Entity * e) {
+		if constexpr (System::query::template matches<Held>()) {
+			system(e);
+		}
+	}
+
+	struct dynamic_callback {
+		void const * context;
+		void (*call)(void const *, std::span<void * const>);
+	};
+
+	using dynamic_visitor = void (*)(ECS &, dynamic_callback);
+
+	template<class ... Lists>
+	static constexpr auto make_dynamic_visitors(ListsViaTypes::TypeList<Lists...>) -> std::array<dynamic_visitor, sizeof...(Lists)> {
+		return { &visit_archetype_dynamically<Lists>... };
+	}
+
+	template<class List>
+	static void visit_archetype_dynamically(ECS & ecs, dynamic_callback callback) {
+		ecs.visit_rows_dynamically(List{}, callback);
+	}
+
+	template<class ... HeldComponents>
+	void visit_rows_dynamically(ListsViaTypes::TypeList<HeldComponents...>, dynamic_callback callback) {
+		using EntityType = entity<ListsViaTypes::TypeList<HeldComponents...>>;
+
+		std::array<void *, ListOfTypes::size()> row{};
+
+		for (auto & up : std::get<ArchetypeContainerModel<EntityType>>(archetype_storage)) {
+			((row[component_id<HeldComponents>()] = &up->template get_component<HeldComponents>()), ...);
+			callback.call(callback.context, row);
+		}
+	}
+
+	template<class ... HeldComponents>
+	static constexpr component_mask signature_of(ListsViaTypes::TypeList<HeldComponents...>) {
+		return mask_of<HeldComponents...>();
+	}
+
+	auto matching_archetypes(component_mask include, component_mask exclude) -> std::vector<size_t> const & {
+		auto [itr, inserted] = query_cache.try_emplace(query_key{ include, exclude });
+
+		if (inserted) {
+			size_t index = 0;
+
+			auto match = [&itr, &index, include, exclude]<class List>() mutable -> void {
+				constexpr component_mask signature = signature_of(List{});
+				if ((signature & include) == include && (signature & exclude) == 0) {
+					itr->second.push_back(index);
+				}
+				++index;
+			};
+
+			ArchetypeTypeList::template call_on_each_type(match);
+		}
+
+		return itr->second;
+	}
+
+	struct query_key {
+		component_mask include;
+		component_mask exclude;
+
+		bool operator==(query_key const &) const = default;
+	};
+
+	struct query_key_hash {
+		size_t operator()(query_key const & key) const noexcept {
+			return std::hash<component_mask>{}(key.include * 0x9E3779B97F4A7C15ull ^ key.exclude);
+		}
+	};
+
+	template<class ... HeldComponents>
+	void compact_rows(ListsViaTypes::TypeList<HeldComponents...>) {
+		using EntityType = entity<ListsViaTypes::TypeList<HeldComponents...>>;
+
+		auto & rows = std::get<ArchetypeContainerModel<EntityType>>(archetype_storage);
+
+		auto relocate = [this, &rows]<class C>() mutable -> void {
+			std::vector<C *> stale;
+			for (auto & up : rows) {
+				stale.push_back(&up->template get_component<C>());
+			}
+
+			auto & components = std::get<ComponentContainerModel<C>>(component_storage);
+			auto relocated = components.create_moved_from(stale);
+
+			size_t row = 0;
+			for (auto & up : rows) {
+				up->template set_component<C>(relocated[row++]);
+			}
+
+			components.remove_all(std::move(stale));
+		};
+
+		(relocate.template operator()<HeldComponents>(), ...);
+	}
+
+	template<class ... ComponentTypes>
+	auto spawn(size_t id) -> entity<ListsViaTypes::TypeList<ComponentTypes...>> * {
 		using EntityType = entity<ListsViaTypes::TypeList<ComponentTypes...>>;
 
 		ArchetypeContainerModel<EntityType> & this_archetype = std::get<ArchetypeContainerModel<EntityType>>(archetype_storage);
 
 		auto * instance = this_archetype.create_new();
+		instance->id = id;
 
-		((instance->set_component<ComponentTypes>(std::get<ComponentContainerModel<ComponentTypes>>(component_storage).create_new())),...);
+		((instance->template set_component<ComponentTypes>(std::get<ComponentContainerModel<ComponentTypes>>(component_storage).create_new())),...);
+
+		if (auto & pending = std::get<archetype_events<ListsViaTypes::TypeList<ComponentTypes...>>>(events); pending.observed()) {
+			pending.added.push_back(instance);
+		}
 
 		return instance;
 	}
 
-private:
+	template<class T, class Functional, class ObserverList>
+	void add_observer(Functional const & f, ObserverList observers_of) {
+		static_assert(ListOfTypes::template contains<T>(), "on_added() and on_removed() called with a type not in the ECS type list.");
+
+		auto add = [this, &f, &observers_of]<class List>() mutable -> void {
+			if constexpr (List::template contains<T>()) {
+				observers_of(std::get<archetype_events<List>>(events)).emplace_back(f);
+			}
+		};
+
+		ArchetypeTypeList::template call_on_each_type(add);
+	}
+
+	template<class ... HeldComponents>
+	void flush_archetype_events(ListsViaTypes::TypeList<HeldComponents...>) {
+		auto & pending = std::get<archetype_events<ListsViaTypes::TypeList<HeldComponents...>>>(events);
+
+		if (!pending.added.empty()) {
+			pending.added_in_flight.swap(pending.added);
+			for (auto & observer : pending.on_added) {
+				observer(pending.added_in_flight);
+			}
+			pending.added_in_flight.clear();
+		}
+
+		if (!pending.removed.empty()) {
+			pending.removed_in_flight.swap(pending.removed);
+			pending.graveyard_in_flight.swap(pending.graveyard);
+			for (auto & observer : pending.on_removed) {
+				observer(pending.removed_in_flight);
+			}
+
+			[[maybe_unused]] auto release_components = [this, &pending]<class C>() mutable -> void {
+				std::vector<C *> dead;
+				dead.reserve(pending.graveyard_in_flight.size());
+				for (auto & up : pending.graveyard_in_flight) {
+					dead.push_back(&up->template get_component<C>());
+				}
+
+				std::get<ComponentContainerModel<C>>(component_storage).remove_all(std::move(dead));
+			};
+
+			(release_components.template operator()<HeldComponents>(), ...);
+
+			pending.removed_in_flight.clear();
+			pending.graveyard_in_flight.clear();
+		}
+	}
+
+	template<class ... HeldComponents>
+	void capture_archetype(archetype_snapshot<ListsViaTypes::TypeList<HeldComponents...>> & out) const {
+		using EntityType = entity<ListsViaTypes::TypeList<HeldComponents...>>;
+
+		std::vector<EntityType const *> rows;
+		for (auto const & up : std::get<ArchetypeContainerModel<EntityType>>(archetype_storage)) {
+			rows.push_back(up.get());
+		}
+
+		std::sort(rows.begin(), rows.end(), [](auto const * lhs, auto const * rhs) {
+			return lhs->id < rhs->id;
+		});
+
+		out.ids.reserve(rows.size());
+		(std::get<std::vector<HeldComponents>>(out.columns).reserve(rows.size()), ...);
+
+		for (auto const * e : rows) {
+			out.ids.push_back(e->id);
+			(std::get<std::vector<HeldComponents>>(out.columns).push_back(e->template get_component<HeldComponents>()), ...);
+		}
+	}
+
+	template<class ... HeldComponents>
+	static void write_archetype_delta(size_t archetype_tag,
+		archetype_snapshot<ListsViaTypes::TypeList<HeldComponents...>> const & from,
+		archetype_snapshot<ListsViaTypes::TypeList<HeldComponents...>> const & to,
+		std::ostream & out) {
+		using held_components = ListsViaTypes::TypeList<HeldComponents...>;
+		static_assert(sizeof...(HeldComponents) <= 64, "ECS::write_delta() keeps the changed component mask in 64 bits.");
+
+		struct changed_row {
+			size_t from_row;
+			size_t to_row;
+			std::uint64_t mask;
+		};
+
+		std::vector<size_t> spawned;
+		std::vector<size_t> despawned;
+		std::vector<changed_row> changed;
+
+		size_t i = 0;
+		size_t j = 0;
+		while (i < from.ids.size() || j < to.ids.size()) {
+			if (j == to.ids.size() || (i < from.ids.size() && from.ids[i] < to.ids[j])) {
+				despawned.push_back(from.ids[i++]);
+			}
+			else if (i == from.ids.size() || to.ids[j] < from.ids[i]) {
+				spawned.push_back(j++);
+			}
+			else {
+				std::uint64_t mask = 0;
+				((mask |= (std::get<std::vector<HeldComponents>>(from.columns)[i] == std::get<std::vector<HeldComponents>>(to.columns)[j])
+					? 0u : (std::uint64_t{ 1 } << held_components::template get_index_of<HeldComponents>())), ...);
+
+				if (mask != 0) {
+					changed.push_back({ i, j, mask });
+				}
+				++i;
+				++j;
+			}
+		}
+
+		if (spawned.empty() && despawned.empty() && changed.empty()) {
+			return;
+		}
+
+		jl::write_varint(out, archetype_tag);
+
+		size_t previous_id = 0;
+		jl::write_varint(out, spawned.size());
+		for (auto row : spawned) {
+			jl::write_varint(out, to.ids[row] - previous_id);
+			previous_id = to.ids[row];
+			(jl::serializer<HeldComponents>::write(out, std::get<std::vector<HeldComponents>>(to.columns)[row]), ...);
+		}
+
+		previous_id = 0;
+		jl::write_varint(out, despawned.size());
+		for (auto id : despawned) {
+			jl::write_varint(out, id - previous_id);
+			previous_id = id;
+		}
+
+		previous_id = 0;
+		jl::write_varint(out, changed.size());
+		for (auto const & row : changed) {
+			jl::write_varint(out, to.ids[row.to_row] - previous_id);
+			previous_id = to.ids[row.to_row];
+			jl::write_varint(out, row.mask);
+
+			[[maybe_unused]] auto write_if_changed = [&out, &to, &row]<class C>() -> void {
+				if (row.mask & (std::uint64_t{ 1 } << held_components::template get_index_of<C>())) {
+					jl::serializer<C>::write(out, std::get<std::vector<C>>(to.columns)[row.to_row]);
+				}
+			};
+
+			(write_if_changed.template operator()<HeldComponents>(), ...);
+		}
+	}
+
+	template<class ... HeldComponents>
+	void apply_archetype_delta(ListsViaTypes::TypeList<HeldComponents...>, std::istream & in) {
+		using held_components = ListsViaTypes::TypeList<HeldComponents...>;
+		using EntityType = entity<held_components>;
+
+		size_t id = 0;
+		auto spawned = jl::read_varint(in);
+		for (size_t n = 0; n < spawned; ++n) {
+			id += jl::read_varint(in);
+			last_id = std::max<size_t>(last_id, id);
+
+			[[maybe_unused]] auto * e = spawn<HeldComponents...>(id);
+			(jl::serializer<HeldComponents>::read(in, e->template get_component<HeldComponents>()), ...);
+		}
+
+		// Built only when the delta touches existing entities of this archetype.
+		std::unordered_map<size_t, EntityType *> by_id;
+		auto find = [this, &by_id](size_t wanted) -> EntityType * {
+			if (by_id.empty()) {
+				for (auto & up : std::get<ArchetypeContainerModel<EntityType>>(archetype_storage)) {
+					by_id.emplace(up->id, up.get());
+				}
+			}
+
+			auto itr = by_id.find(wanted);
+			if (itr == by_id.end()) {
+				throw std::runtime_error("ECS::apply_delta() refers to an entity which this ECS does not have.");
+			}
+			return itr->second;
+		};
+
+		id = 0;
+		auto despawned = jl::read_varint(in);
+		std::vector<EntityType *> doomed;
+		doomed.reserve(despawned);
+		for (size_t n = 0; n < despawned; ++n) {
+			id += jl::read_varint(in);
+			doomed.push_back(find(id));
+			by_id.erase(id);
+		}
+		if (!doomed.empty()) {
+			destroy_entities(std::move(doomed));
+		}
+
+		id = 0;
+		auto changed = jl::read_varint(in);
+		for (size_t n = 0; n < changed; ++n) {
+			id += jl::read_varint(in);
+			auto mask = jl::read_varint(in);
+			auto * e = find(id);
+
+			[[maybe_unused]] auto read_if_changed = [&in, e, mask]<class C>() -> void {
+				if (mask & (std::uint64_t{ 1 } << held_components::template get_index_of<C>())) {
+					jl::serializer<C>::read(in, e->template get_component<C>());
+				}
+			};
+
+			(read_if_changed.template operator()<HeldComponents>(), ...);
+		}
+
+		if (!in) {
+			throw std::runtime_error("ECS::apply_delta() could not read the whole delta.");
+		}
+	}
+
+	template<class Functional, class ... Rs>
+	jl::system_task budgeted_pass(jl::frame_scheduler & scheduler, Functional f, ListsViaTypes::TypeList<Rs...>) {
+		(co_await budgeted_archetype_pass<typename Rs::held_components>(scheduler, f), ...);
+	}
+
+	template<class List, class Functional>
+	jl::system_task budgeted_archetype_pass(jl::frame_scheduler & scheduler, Functional & f) {
+		auto & storage = get_storage_for_archetypes<List>();
+
+		for (size_t row = 0; row < storage.size(); ++row) {
+			f(storage.begin()[row].get());
+			co_await scheduler.checkpoint();
+		}
+	}
+
+	size_t last_id = 0;
+	std::unordered_map<query_key, std::vector<size_t>, query_key_hash> query_cache;
+	ArchetypeTypeList::template apply_to_each<archetype_events>::as_tuple events;
+	jl::frame_clock clock;
 	ListOfTypes::template apply_to_each<ComponentContainerModel>::as_tuple component_storage;
 	Archetypes::template apply_to_each<ArchetypeContainerModel>::as_tuple archetype_storage;
 
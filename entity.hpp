@@ -1,7 +1,8 @@
 #ifndef Entity_H
 #define Entity_H 1
 
-#include <atomic>
+#include <array>
+#include <cstdint>
 #include <memory>
 #include <optional>
 #include <type_traits>
@@ -34,15 +35,14 @@ public:
 	}
 
 	Entity(ComponentTypes && ... components)
-		: id(0), storage() {
-        (storage.template make_in_place<ComponentTypes>(std::move(components)), ...);
+		: id(0), storage(std::optional<ComponentTypes>(std::move(components))...) {
 	}
 
 	template<typename T>
 	T * get_component() noexcept {
 		static_assert(ArgsTypeList::template contains<T>(), "Entity::get_component() called on type not in TypeList.");
 
-        return storage.template get<T>();
+        return get_value<T>();
 	}
 
 
@@ -51,21 +51,23 @@ public:
 	T const * get_component() const noexcept {
 		static_assert(ArgsTypeList::template contains<T>(), "Entity::get_component() called on type not in TypeList.");
 
-        return storage.template get<T>();
+        return get_value<T>();
 	}
 
 	template<typename T>
 	T* get_value() noexcept {
 		static_assert(ArgsTypeList::template contains<T>(), "Entity::get_component() called on type not in TypeList.");
 
-        return storage.template get<T>();
+        auto & maybe_t = std::get<std::optional<T>>(storage);
+        return maybe_t.has_value() ? std::addressof(*maybe_t) : nullptr;
 	}
 
 	template<typename T>
 	T const* get_value() const noexcept {
 		static_assert(ArgsTypeList::template contains<T>(), "Entity::get_component() called on type not in TypeList.");
 
-        return storage.template get<T>();
+        auto const & maybe_t = std::get<std::optional<T>>(storage);
+        return maybe_t.has_value() ? std::addressof(*maybe_t) : nullptr;
 	}
 
 private:
@@ -90,27 +92,86 @@ public:
 
 	void reserve(size_t desired_capacity) {
 		entity_storage.reserve(desired_capacity);
+		slots.reserve(slots.size() + desired_capacity);
+		free_slots.reserve(slots.capacity());
 		(get_storage_for_component<ComponentTypes>().reserve(desired_capacity),...);
+		for (auto & owners : component_owners) {
+			owners.reserve(desired_capacity);
+		}
 	}
 
 	template<typename ... Ts>
 	void make_entity(Ts&& ... ts) {
-		auto new_entity = std::make_unique<Entity_t>(std::forward<Ts>(ts)...);
-		auto* address = new_entity.get();
-
-		entity_storage.push_back(std::move(new_entity));
-
-		address->id = ++global_id;
-		register_entity(*address);
+		push_back(std::make_unique<Entity_t>(std::forward<Ts>(ts)...));
 	}
 	
+	// Every allocation happens up front, so if one throws the manager is left as it was.
 	void push_back(std::unique_ptr<Entity_t> entity) {
 		auto& actual_entity = *entity;
+
+		bool reuse_slot = !free_slots.empty();
+		make_room_for(actual_entity, !reuse_slot);
+
+		size_t slot_index;
+		if (reuse_slot) {
+			slot_index = free_slots.back();
+			free_slots.pop_back();
+		}
+		else {
+			slot_index = slots.size();
+			slots.emplace_back();
+		}
+
 		entity_storage.push_back(std::move(entity));
 
-		register_entity(actual_entity);
-		actual_entity.id = ++global_id;
-		
+		auto & s = slots[slot_index];
+		actual_entity.id = (size_t{ s.generation } << 32) | slot_index;
+		s.entity = &actual_entity;
+		s.index = entity_storage.size() - 1;
+
+		register_entity(actual_entity, slot_index);
+	}
+
+	// Constant time, through a slot array. An id holds a slot index in its low 32 bits and the
+	// slot's generation in its high 32 bits. Slots of removed entities are reused, and the bumped
+	// generation makes the old id miss instead of finding the new occupant.
+	Entity_t * find_entity(size_t id) noexcept {
+		auto slot_index = slot_of(id);
+		return slot_index < slots.size() && slots[slot_index].generation == generation_of(id) ? slots[slot_index].entity : nullptr;
+	}
+
+	Entity_t const * find_entity(size_t id) const noexcept {
+		auto slot_index = slot_of(id);
+		return slot_index < slots.size() && slots[slot_index].generation == generation_of(id) ? slots[slot_index].entity : nullptr;
+	}
+
+	// Constant time. The last entity, and the last pointer in each component storage, is swapped
+	// into the hole, so the order of get_storage_for_entities() and get_storage_for_component() changes.
+	bool remove_entity(size_t id) {
+		if (find_entity(id) == nullptr) {
+			return false;
+		}
+
+		auto slot_index = slot_of(id);
+		unregister_entity(slot_index);
+
+		size_t index = slots[slot_index].index;
+		if (index + 1 != entity_storage.size()) {
+			std::swap(entity_storage[index], entity_storage.back());
+			slots[slot_of(entity_storage[index]->id)].index = index;
+		}
+
+		entity_storage.pop_back();
+
+		auto & s = slots[slot_index];
+		s.entity = nullptr;
+		// Generation 0 is skipped so that no id is ever 0.
+		if (++s.generation == 0) {
+			s.generation = 1;
+		}
+		free_slots.push_back(slot_index);
+
+		return true;
 	}
 
 	auto const & get_storage_for_entities() const noexcept{
@@ -137,18 +198,58 @@ public:
 
 private:
 
-	void register_entity(Entity_t & e) {
+	static size_t slot_of(size_t id) noexcept {
+		return id & 0xffffffffu;
+	}
+
+	static std::uint32_t generation_of(size_t id) noexcept {
+		return static_cast<std::uint32_t>(id >> 32);
+	}
+
+	// Grows like push_back() would, so the push_back() calls which follow cannot throw.
+	template<typename Container>
+	static void grow_if_full(Container & c) {
+		if (c.size() == c.capacity()) {
+			c.reserve(c.size() < 8 ? 8 : 2 * c.size());
+		}
+	}
+
+	// free_slots can hold every slot, so remove_entity() never allocates.
+	void make_room_for(Entity_t & e, bool new_slot) {
+		grow_if_full(entity_storage);
+		if (new_slot) {
+			grow_if_full(slots);
+			if (free_slots.capacity() < slots.capacity()) {
+				free_slots.reserve(slots.capacity());
+			}
+		}
+
+		auto make_room_for_component = [this, &e]<class T>() mutable -> void {
+			if (e.template get_component<T>() != nullptr) {
+				grow_if_full(this->get_storage_for_component<T>());
+				grow_if_full(component_owners[ArgsTypeList::template get_index_of<T>()]);
+			}
+		};
+
+		(make_room_for_component.template operator()<ComponentTypes>(), ...);
+	}
+
+	void register_entity(Entity_t & e, size_t slot_index) {
 
 	// I finally got a chance to use generic lambdas
 	// Woe is me
 
 
-            auto try_register_all_components = [this](auto& entity) mutable {
+            auto try_register_all_components = [this, slot_index](auto& entity) mutable {
 
-                auto try_register_component = [this]<class T>(auto & entity) mutable {
-                    auto maybe_push_back_component_address = [this] <class R> (auto & entity, auto & storage_for_R) mutable -> void {
+                auto try_register_component = [this, slot_index]<class T>(auto & entity) mutable {
+                    auto maybe_push_back_component_address = [this, slot_index] <class R> (auto & entity, auto & storage_for_R) mutable -> void {
                         if (entity.template get_component<R>() != nullptr) {
+                            constexpr auto I = ArgsTypeList::template get_index_of<R>();
+
                             storage_for_R.push_back(entity.template get_component<R>());
+                            component_owners[I].push_back(slot_index);
+                            slots[slot_index].component_index[I] = storage_for_R.size() - 1;
                         }
                     };
 
@@ -161,9 +262,45 @@ private:
             try_register_all_components(e);
 	}
 
+	// component_owners[I] runs parallel to the storage of the I-th component type and holds the
+	// slot of each pointer's entity, so the pointer swapped into the hole can be re-indexed.
+	void unregister_entity(size_t slot_index) {
+		auto unregister_component = [this, slot_index]<class T>() mutable -> void {
+			if (slots[slot_index].entity->template get_component<T>() == nullptr) {
+				return;
+			}
+
+			constexpr auto I = ArgsTypeList::template get_index_of<T>();
+			auto & components = this->get_storage_for_component<T>();
+			auto & owners = component_owners[I];
+			size_t index = slots[slot_index].component_index[I];
+
+			if (index + 1 != components.size()) {
+				components[index] = components.back();
+				owners[index] = owners.back();
+				slots[owners[index]].component_index[I] = index;
+			}
+
+			components.pop_back();
+			owners.pop_back();
+		};
+
+		(unregister_component.template operator()<ComponentTypes>(), ...);
+	}
+
+	struct slot {
+		Entity_t * entity = nullptr;
+		size_t index = 0;
+		std::uint32_t generation = 1;
+		// Position of each component's pointer in its storage. Only meaningful for components the entity has.
+		std::array<size_t, sizeof...(ComponentTypes)> component_index{};
+	};
+
 
-	std::atomic<size_t> global_id;
 	typename std::vector<std::unique_ptr<Entity_t>> entity_storage;
+	std::vector<slot> slots;
+	std::vector<size_t> free_slots;
+	std::array<std::vector<size_t>, sizeof...(ComponentTypes)> component_owners;
 	typename ListsViaTypes::TypeList<ComponentTypes...>::template apply_to_each<std::add_pointer_t>::template apply_to_each<ContainerModel>::as_tuple storage;
 };
 #endif
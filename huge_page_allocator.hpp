@@ -0,0 +1,345 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+
+#include "set.hpp"
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace jl {
+
+    // Hands out small objects from 2 MiB chunks mapped with mmap. On Linux each chunk asks for
+    // transparent huge pages and is bound to one NUMA node. There is one arena per node, and a
+    // thread allocates from the arena of the node it is running on. Without THP or NUMA support
+    // the hints fail quietly and the chunks behave like ordinary 4 KiB pages. Off Linux, and for
+    // objects too large to share a chunk, allocation goes to operator new.
+    //
+    // Each thread keeps a small cache of free blocks per size class, taken from and returned to
+    // its arena in batches, so most allocations and deallocations do not touch the arena's lock.
+    class chunk_arena {
+    public:
+        static constexpr size_t chunk_size = size_t{ 2 } << 20;
+        static constexpr size_t granularity = alignof(std::max_align_t);
+        static constexpr size_t largest_object = 4096;
+        static constexpr unsigned max_nodes = 64;
+        // Blocks moved between a thread cache and its arena at a time.
+        static constexpr unsigned batch = 32;
+        // Allocations between two checks of which node the thread is running on.
+        static constexpr unsigned node_check_interval = 1024;
+
+        static void * allocate(size_t size, size_t alignment) {
+            if (!fits_in_chunk(size, alignment)) {
+                return ::operator new(size, std::align_val_t{ alignment });
+            }
+
+            auto & cache = local_cache();
+            auto size_class = size_class_of(size);
+
+            if (cache.allocations_until_node_check == 0) {
+                cache.use_arena(for_node(current_node()));
+            }
+            --cache.allocations_until_node_check;
+
+            if (cache.blocks[size_class] == nullptr) {
+                cache.blocks[size_class] = cache.arena->take_batch(size_class, cache.counts[size_class]);
+            }
+
+            auto * block = cache.blocks[size_class];
+            cache.blocks[size_class] = block->next;
+            --cache.counts[size_class];
+            return block;
+        }
+
+        static void deallocate(void * p, size_t size, size_t alignment) noexcept {
+            if (!fits_in_chunk(size, alignment)) {
+                ::operator delete(p, std::align_val_t{ alignment });
+                return;
+            }
+
+            // Chunks are aligned to their size, and the first bytes of each chunk hold its owner.
+            auto * chunk = reinterpret_cast<chunk_header *>(reinterpret_cast<std::uintptr_t>(p) & ~(chunk_size - 1));
+            auto size_class = size_class_of(size);
+            auto & cache = local_cache();
+
+            // Only blocks of the thread's own arena are cached, so a cache never holds memory
+            // of another node.
+            if (chunk->owner != cache.arena) {
+                chunk->owner->deallocate_small(p, size_class);
+                return;
+            }
+
+            auto * block = static_cast<free_block *>(p);
+            block->next = cache.blocks[size_class];
+            cache.blocks[size_class] = block;
+            if (++cache.counts[size_class] > 2 * batch) {
+                cache.give_back(size_class, batch);
+            }
+        }
+
+    private:
+        struct free_block {
+            free_block * next;
+        };
+
+        struct chunk_header {
+            chunk_arena * owner;
+        };
+
+        static constexpr size_t size_classes = largest_object / granularity;
+
+        struct thread_cache {
+            chunk_arena * arena = nullptr;
+            unsigned allocations_until_node_check = 0;
+            std::array<free_block *, size_classes> blocks{};
+            std::array<unsigned, size_classes> counts{};
+
+            thread_cache() = default;
+            thread_cache(thread_cache const &) = delete;
+            thread_cache & operator=(thread_cache const &) = delete;
+
+            // Blocks freed by this thread after its cache is gone go straight to their arena.
+            ~thread_cache() {
+                give_back_all();
+                arena = nullptr;
+            }
+
+            void use_arena(chunk_arena & node_arena) noexcept {
+                if (arena != &node_arena) {
+                    give_back_all();
+                    arena = &node_arena;
+                }
+                allocations_until_node_check = node_check_interval;
+            }
+
+            // Returns the first count blocks of one size class to the arena under a single lock.
+            void give_back(size_t size_class, unsigned count) noexcept {
+                auto * first = blocks[size_class];
+                auto * last = first;
+                for (unsigned i = 1; i < count; ++i) {
+                    last = last->next;
+                }
+
+                blocks[size_class] = last->next;
+                counts[size_class] -= count;
+                arena->put_batch(size_class, first, last);
+            }
+
+            void give_back_all() noexcept {
+                for (size_t size_class = 0; size_class < size_classes; ++size_class) {
+                    if (counts[size_class] != 0) {
+                        give_back(size_class, counts[size_class]);
+                    }
+                }
+            }
+        };
+
+        static thread_cache & local_cache() noexcept {
+            thread_local thread_cache cache;
+            return cache;
+        }
+
+        static bool fits_in_chunk(size_t size, size_t alignment) noexcept {
+#if defined(__linux__)
+            return size <= largest_object && alignment <= granularity;
+#else
+            (void)size;
+            (void)alignment;
+            return false;
+#endif
+        }
+
+        static size_t size_class_of(size_t size) noexcept {
+            return (size == 0 ? 0 : (size - 1) / granularity);
+        }
+
+        // getcpu() goes through the vDSO, so it does not enter the kernel. Older glibc lacks the
+        // wrapper and falls back to the system call, which thread_cache only makes now and then.
+        static unsigned current_node() noexcept {
+            unsigned node = 0;
+#if defined(__linux__)
+            unsigned cpu = 0;
+#if defined(__GLIBC__) && (__GLIBC__ * 100 + __GLIBC_MINOR__) >= 229
+            if (getcpu(&cpu, &node) != 0) {
+                node = 0;
+            }
+#elif defined(SYS_getcpu)
+            if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+                node = 0;
+            }
+#endif
+#endif
+            return node < max_nodes ? node : 0;
+        }
+
+        static chunk_arena & for_node(unsigned node) {
+            static std::array<chunk_arena, max_nodes> arenas;
+            static std::once_flag numbered;
+
+            std::call_once(numbered, [] {
+                for (unsigned i = 0; i < max_nodes; ++i) {
+                    arenas[i].node = i;
+                }
+            });
+
+            return arenas[node];
+        }
+
+        // Hands out up to batch blocks as a list, reusing freed blocks first. A new chunk is only
+        // mapped when nothing at all is left, so a partial batch is returned rather than wasting
+        // the end of the current chunk. Blocks are listed in the order they were carved, so fresh
+        // memory comes out at rising addresses, which set::create_new() turns into appends.
+        free_block * take_batch(size_t size_class, unsigned & count) {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            free_block * taken = nullptr;
+            free_block ** tail = &taken;
+            size_t bytes = (size_class + 1) * granularity;
+
+            while (count < batch) {
+                auto * block = free_lists[size_class];
+                if (block != nullptr) {
+                    free_lists[size_class] = block->next;
+                }
+                else {
+                    if (cursor == nullptr || static_cast<size_t>(chunk_end - cursor) < bytes) {
+                        if (taken != nullptr) {
+                            break;
+                        }
+                        map_chunk();
+                    }
+
+                    block = reinterpret_cast<free_block *>(cursor);
+                    cursor += bytes;
+                }
+
+                block->next = nullptr;
+                *tail = block;
+                tail = &block->next;
+                ++count;
+            }
+
+            return taken;
+        }
+
+        void put_batch(size_t size_class, free_block * first, free_block * last) noexcept {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            last->next = free_lists[size_class];
+            free_lists[size_class] = first;
+        }
+
+        void deallocate_small(void * p, size_t size_class) noexcept {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            auto * block = static_cast<free_block *>(p);
+            block->next = free_lists[size_class];
+            free_lists[size_class] = block;
+        }
+
+        // Chunks are never unmapped. Freed blocks are reused through the free lists instead.
+        // The kernel places separate mappings at falling addresses, so chunks are instead cut in
+        // order from one large reservation, and each chunk lies above the one before.
+        void map_chunk() {
+#if defined(__linux__)
+            if (reserved_next == reserved_end) {
+                reserve_address_space();
+            }
+
+            auto * chunk = reserved_next;
+            if (mprotect(chunk, chunk_size, PROT_READ | PROT_WRITE) != 0) {
+                throw std::bad_alloc();
+            }
+            reserved_next += chunk_size;
+
+#if defined(MADV_HUGEPAGE)
+            madvise(chunk, chunk_size, MADV_HUGEPAGE);
+#endif
+#if defined(SYS_mbind)
+            // MPOL_PREFERRED, so a full node spills to its neighbours instead of failing.
+            constexpr int mpol_preferred = 1;
+            unsigned long node_mask = 1ul << node;
+            syscall(SYS_mbind, chunk, chunk_size, mpol_preferred, &node_mask, sizeof(node_mask) * 8, 0);
+#endif
+
+            reinterpret_cast<chunk_header *>(chunk)->owner = this;
+            cursor = chunk + ((sizeof(chunk_header) + granularity - 1) / granularity) * granularity;
+            chunk_end = chunk + chunk_size;
+#endif
+        }
+
+#if defined(__linux__)
+        // Address space only. PROT_NONE and MAP_NORESERVE commit no memory until map_chunk()
+        // opens a chunk. A later reservation may lie below an earlier one, which costs speed but
+        // not correctness.
+        void reserve_address_space() {
+            // One chunk extra so an aligned range can be cut out of it.
+            void * mapping = mmap(nullptr, reserved_size + chunk_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (mapping == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+
+            auto begin = reinterpret_cast<std::uintptr_t>(mapping);
+            auto aligned = (begin + chunk_size - 1) & ~(chunk_size - 1);
+            if (aligned != begin) {
+                munmap(mapping, aligned - begin);
+            }
+            if (auto tail = begin + reserved_size + chunk_size - (aligned + reserved_size); tail != 0) {
+                munmap(reinterpret_cast<void *>(aligned + reserved_size), tail);
+            }
+
+            reserved_next = reinterpret_cast<char *>(aligned);
+            reserved_end = reserved_next + reserved_size;
+        }
+#endif
+
+        // 32 GiB of address space per reservation.
+        static constexpr size_t reserved_size = size_t{ 16384 } * chunk_size;
+
+        std::mutex mutex;
+        unsigned node = 0;
+        char * cursor = nullptr;
+        char * chunk_end = nullptr;
+        char * reserved_next = nullptr;
+        char * reserved_end = nullptr;
+        std::array<free_block *, size_classes> free_lists{};
+    };
+
+    template<class T>
+    struct huge_page_allocator {
+        using value_type = T;
+
+        huge_page_allocator() noexcept = default;
+
+        template<class U>
+        huge_page_allocator(huge_page_allocator<U> const &) noexcept { }
+
+        T * allocate(size_t n) {
+            return static_cast<T *>(chunk_arena::allocate(n * sizeof(T), alignof(T)));
+        }
+
+        void deallocate(T * p, size_t n) noexcept {
+            chunk_arena::deallocate(p, n * sizeof(T), alignof(T));
+        }
+
+        template<class U>
+        bool operator==(huge_page_allocator<U> const &) const noexcept {
+            return true;
+        }
+    };
+
+    namespace containers {
+        // Envisioned use
+        // using myECS = ECS<huge_page_set, huge_page_set, ComponentsList>;
+        template<class T>
+        using huge_page_set = set<T, huge_page_allocator<T>>;
+    }
+}
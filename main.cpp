@@ -1,11 +1,94 @@
 #include "ecs.hpp"
+#include "entity.hpp"
 
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <span>
 #include <string>
 #include <vector>
 
+#include "huge_page_allocator.hpp"
 #include "set.hpp"
 
+int entity_manager_demo() {
+    using namespace ListsViaTypes;
+    using ComponentsList = TypeList<int,std::string,std::map<int,int>>;
+//    using ComponentsAsOptionalTuple = ComponentsList::template apply_to_each<std::optional>::as_tuple;
+    using EntityType = Entity<ComponentsList>;
+    using EntityManagerType = EntityManager<EntityType, std::vector>;
+
+
+    EntityManagerType a;
+
+    a.reserve(10);
+    a.make_entity(6, std::string("abc"), std::map<int,int>({std::make_pair(1,1)}));
+    a.make_entity(7, std::string("efg"), std::map<int,int>({std::make_pair(2,2)}));
+    a.make_entity(8, std::string("hij"), std::map<int,int>({std::make_pair(3,3)}));
+    a.make_entity(9, std::string("klm"), std::map<int,int>({std::make_pair(4,4)}));
+
+
+    for(auto *number : a.get_storage_for_component<int>()) {
+	    std::cout << *number << std::endl;
+    }
+
+    for(auto *word : a.get_storage_for_component<std::string>()) {
+	    std::cout << *word << std::endl;
+    }
+
+    for(auto *map : a.get_storage_for_component<std::map<int,int>>()) {
+            for(auto & [key,value] : *map) {
+	        std::cout << value << std::endl;
+	    }
+    }
+
+    std::vector<size_t> ids;
+    for (auto & e : a.get_storage_for_entities()) {
+        ids.push_back(e->id);
+    }
+
+    auto fail = [](char const * what) {
+        std::cout << "EntityManager: " << what << std::endl;
+        return EXIT_FAILURE;
+    };
+
+    for (size_t i = 0; i < ids.size(); ++i) {
+        auto * e = a.find_entity(ids[i]);
+        if (e == nullptr || *e->get_component<int>() != 6 + static_cast<int>(i)) {
+            return fail("find_entity() missed a live entity");
+        }
+    }
+
+    // Remove "efg", then let a new entity take over its slot. The old id must stay dead.
+    size_t removed_id = ids[1];
+    if (!a.remove_entity(removed_id) || a.find_entity(removed_id) != nullptr || a.remove_entity(removed_id)) {
+        return fail("remove_entity() left the entity reachable");
+    }
+    if (a.get_storage_for_component<std::string>().size() != 3 || a.get_storage_for_entities().size() != 3) {
+        return fail("remove_entity() left components behind");
+    }
+
+    a.make_entity(10, std::string("nop"), std::map<int,int>({std::make_pair(5,5)}));
+    size_t reused_id = a.get_storage_for_entities().back()->id;
+    if ((reused_id & 0xffffffffu) != (removed_id & 0xffffffffu) || reused_id == removed_id) {
+        return fail("make_entity() did not reuse the free slot under a new generation");
+    }
+    if (a.find_entity(removed_id) != nullptr) {
+        return fail("a stale id found the entity which reused its slot");
+    }
+    if (auto * e = a.find_entity(reused_id); e == nullptr || *e->get_component<std::string>() != "nop") {
+        return fail("find_entity() missed the entity in the reused slot");
+    }
+    for (size_t i : { size_t{ 0 }, size_t{ 2 }, size_t{ 3 } }) {
+        if (a.find_entity(ids[i]) == nullptr) {
+            return fail("removing one entity lost another");
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
 int main() {
     using namespace ListsViaTypes;
     using namespace jl::containers;
@@ -40,46 +123,92 @@ int main() {
     });*/
 
     auto print = [](auto const& entity) {
-        std::cout << entity->get_component<std::string>() << "\n";
+        std::cout << entity->template get_component<std::string>() << "\n";
     };
 
     ecs->for_each_entity_with_components<TypeList<std::string>>(print);
 
+    // Runtime query, as a script would issue it, through a const callable.
+    size_t with_int = 0;
+    const auto count_row = [&with_int](std::span<void * const>) { ++with_int; };
+    ecs->query(myECS::mask_of<int>(), 0, count_row);
+    if (with_int != 1) {
+        std::cout << "query found " << with_int << " entities with an int\n";
+        return EXIT_FAILURE;
+    }
 
-    return EXIT_SUCCESS;
-}
-
-/*
-int main() {
-    using ComponentsList = TypeList<int,std::string,std::map<int,int>>;
-//    using ComponentsAsOptionalTuple = ComponentsList::template apply_to_each<std::optional>::as_tuple;
-    using EntityType = Entity<ComponentsList>;
-    using EntityManagerType = EntityManager<EntityType, std::vector>;
-
-
-    EntityManagerType a;
-
-    a.reserve(10);
-    a.make_entity(6, std::string("abc"), std::map<int,int>({std::make_pair(1,1)}));
-    a.make_entity(7, std::string("efg"), std::map<int,int>({std::make_pair(2,2)}));
-    a.make_entity(8, std::string("hij"), std::map<int,int>({std::make_pair(3,3)}));
-    a.make_entity(9, std::string("klm"), std::map<int,int>({std::make_pair(4,4)}));
+    // Replicate a world through a file: snapshot, write the delta, apply it to a replica.
+    using ReplicatedECS = ECS<set, set, TypeList<int, std::string>>;
+    auto server = std::make_unique<ReplicatedECS>();
+    auto replica = std::make_unique<ReplicatedECS>();
+    auto delta_path = std::filesystem::temp_directory_path() / "ecs_delta.bin";
+
+    auto replicate = [&](ReplicatedECS::snapshot const & from, ReplicatedECS::snapshot const & to) {
+        {
+            std::ofstream out(delta_path, std::ios::binary);
+            ReplicatedECS::write_delta(from, to, out);
+        }
+        std::ifstream in(delta_path, std::ios::binary);
+        replica->apply_delta(in);
+    };
 
+    auto tick0 = server->take_snapshot();
+    auto * cat = server->create_entity<int, std::string>();
+    cat->get_component<int>() = 9;
+    cat->get_component<std::string>() = "meow";
+    auto * dog = server->create_entity<std::string>();
+    dog->get_component<std::string>() = "woof";
+    auto tick1 = server->take_snapshot();
+    replicate(tick0, tick1);
+
+    cat->get_component<int>() = 8;
+    server->destroy_entity(dog);
+    replicate(tick1, server->take_snapshot());
+    std::filesystem::remove(delta_path);
+
+    auto same_world = [&]() {
+        std::vector<std::string> on_server, on_replica;
+        server->for_each_entity_with_components<TypeList<std::string>>([&](auto const & e) {
+            on_server.push_back(std::to_string(e->id) + e->template get_component<std::string>());
+        });
+        replica->for_each_entity_with_components<TypeList<std::string>>([&](auto const & e) {
+            on_replica.push_back(std::to_string(e->id) + e->template get_component<std::string>());
+        });
+
+        int server_lives = 0, replica_lives = 0;
+        server->for_each_entity_with_components<TypeList<int>>([&](auto const & e) { server_lives += e->template get_component<int>(); });
+        replica->for_each_entity_with_components<TypeList<int>>([&](auto const & e) { replica_lives += e->template get_component<int>(); });
+
+        return on_server == on_replica && server_lives == replica_lives;
+    };
 
-    for(auto *number : a.get_storage_for_component<int>()) {
-	    std::cout << *number << std::endl;
+    if (!same_world()) {
+        std::cout << "replica diverged from server\n";
+        return EXIT_FAILURE;
     }
-
-    for(auto *word : a.get_storage_for_component<std::string>()) {
-	    std::cout << *word << std::endl;
+    std::cout << "replica matches server\n";
+
+    // The same ECS on the chunk allocator.
+    using HugePageECS = ECS<huge_page_set, huge_page_set, TypeList<int, std::string>>;
+    auto pooled = std::make_unique<HugePageECS>();
+    std::vector<HugePageECS::entity<TypeList<int, std::string>> *> spawned;
+    for (int i = 0; i < 1000; ++i) {
+        auto * e = pooled->create_entity<int, std::string>();
+        e->get_component<int>() = i;
+        spawned.push_back(e);
     }
-
-    for(auto *map : a.get_storage_for_component<std::map<int,int>>()) {
-            for(auto & [key,value] : *map) {
-	        std::cout << value << std::endl;
-	    }
+    for (size_t i = 0; i < spawned.size(); i += 2) {
+        pooled->destroy_entity(spawned[i]);
+    }
+    pooled->sort_archetype<TypeList<int, std::string>>([](auto const & e) { return -e.template get_component<int>(); });
+    pooled->compact_archetype<TypeList<int, std::string>>();
+
+    int odd_sum = 0;
+    pooled->for_each_entity_with_components<TypeList<int>>([&](auto const & e) { odd_sum += e->template get_component<int>(); });
+    if (odd_sum != 250000) {
+        std::cout << "huge page ECS lost entities\n";
+        return EXIT_FAILURE;
     }
 
-    return EXIT_SUCCESS;
+    return entity_manager_demo();
 }
-*/
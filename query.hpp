@@ -0,0 +1,77 @@
+#pragma once
+
+#include "TypeList.hpp"
+
+#include <utility>
+
+namespace jl::query {
+
+    // Query terms. Each one is a compile-time predicate over the component list of an archetype,
+    // so archetypes that fail a query are discarded by `if constexpr` and never visited.
+    //
+    // Envisioned use
+    // ecs.for_each_entity_matching<With<Position, Velocity>, Without<Dead>, Optional<Health>>([](auto * e) {
+    //     if (auto * health = e->template try_get_component<Health>()) { ... }
+    // });
+    // try_get_component() is resolved per archetype, so there is no per-entity branch on presence.
+
+    template<class ... Ts>
+    struct With {
+        template<class Held>
+        static constexpr bool matches() {
+            return Held::template contains_all<Ts...>();
+        }
+    };
+
+    template<class ... Ts>
+    struct Without {
+        template<class Held>
+        static constexpr bool matches() {
+            return Held::template contains_none<Ts...>();
+        }
+    };
+
+    template<class ... Ts>
+    struct AnyOf {
+        template<class Held>
+        static constexpr bool matches() {
+            return Held::template contains_any<Ts...>();
+        }
+    };
+
+    // Never excludes an archetype. It only documents that the callback will try_get_component<T>().
+    template<class ... Ts>
+    struct Optional {
+        template<class Held>
+        static constexpr bool matches() {
+            return true;
+        }
+    };
+
+    template<class ... Terms>
+    struct Query {
+        template<class Held>
+        static constexpr bool matches() {
+            return (Terms::template matches<Held>() && ...);
+        }
+    };
+
+    // A per-entity callback together with the query selecting the entities it runs on, so that
+    // ECS::fused() can run several of them in one traversal.
+    template<class QueryType, class Functional>
+    struct system {
+        using query = QueryType;
+
+        Functional f;
+
+        template<class Entity>
+        void operator()(Entity * e) const {
+            f(e);
+        }
+    };
+
+    template<class ... Terms, class Functional>
+    auto make_system(Functional f) -> system<Query<Terms...>, Functional> {
+        return { std::move(f) };
+    }
+}
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <vector>
+
+namespace jl {
+
+    class frame_scheduler;
+
+    // Return type of a system written as a coroutine. A system_task can be handed to a
+    // frame_scheduler or co_awaited from another system_task.
+    //
+    // Envisioned use
+    // jl::system_task recompute_lod(myECS & ecs, jl::frame_scheduler & scheduler) {
+    //     for (;;) {
+    //         co_await ecs.for_each_entity_matching_budgeted<With<Mesh>>(scheduler, update_lod);
+    //         co_await scheduler.next_frame();
+    //     }
+    // }
+    // scheduler.add(recompute_lod(ecs, scheduler));
+    // every tick: scheduler.run_frame(std::chrono::microseconds(2000));
+    class system_task {
+    public:
+        struct promise_type;
+        using handle_type = std::coroutine_handle<promise_type>;
+
+        struct final_awaiter {
+            bool await_ready() const noexcept {
+                return false;
+            }
+
+            std::coroutine_handle<> await_suspend(handle_type h) noexcept {
+                if (auto continuation = h.promise().continuation) {
+                    return continuation;
+                }
+                return std::noop_coroutine();
+            }
+
+            void await_resume() const noexcept { }
+        };
+
+        struct promise_type {
+            std::coroutine_handle<> continuation;
+            std::exception_ptr exception;
+
+            system_task get_return_object() noexcept {
+                return system_task{ handle_type::from_promise(*this) };
+            }
+
+            std::suspend_always initial_suspend() const noexcept {
+                return {};
+            }
+
+            final_awaiter final_suspend() const noexcept {
+                return {};
+            }
+
+            void return_void() const noexcept { }
+
+            void unhandled_exception() noexcept {
+                exception = std::current_exception();
+            }
+        };
+
+        system_task(system_task && other) noexcept : coroutine(std::exchange(other.coroutine, {})) { }
+
+        system_task& operator=(system_task && other) noexcept {
+            if (this != &other) {
+                if (coroutine) {
+                    coroutine.destroy();
+                }
+                coroutine = std::exchange(other.coroutine, {});
+            }
+            return *this;
+        }
+
+        ~system_task() {
+            if (coroutine) {
+                coroutine.destroy();
+            }
+        }
+
+        bool done() const noexcept {
+            return !coroutine || coroutine.done();
+        }
+
+        // Awaiting a system_task runs it as a subroutine of the awaiting one. Suspensions inside it
+        // are seen by the scheduler as suspensions of the outermost task.
+        auto operator co_await() noexcept {
+            struct awaiter {
+                handle_type child;
+
+                bool await_ready() const noexcept {
+                    return child.done();
+                }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<> parent) noexcept {
+                    child.promise().continuation = parent;
+                    return child;
+                }
+
+                void await_resume() const {
+                    if (child.promise().exception) {
+                        std::rethrow_exception(child.promise().exception);
+                    }
+                }
+            };
+
+            return awaiter{ coroutine };
+        }
+
+    private:
+        friend class frame_scheduler;
+
+        explicit system_task(handle_type h) noexcept : coroutine(h) { }
+
+        handle_type coroutine;
+    };
+
+    // Runs system_tasks cooperatively under a time budget per frame. A task keeps its own cursor
+    // in its coroutine frame, so work cut off by the budget continues where it stopped next frame.
+    class frame_scheduler {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        // checkpoint() reads the clock only once per this many calls, so a task may overrun
+        // its budget by up to this many steps of work.
+        static constexpr unsigned checkpoints_per_clock_read = 64;
+
+        void add(system_task task) {
+            auto resume_point = std::coroutine_handle<>(task.coroutine);
+            tasks.push_back({ std::move(task), resume_point });
+        }
+
+        bool empty() const noexcept {
+            return tasks.empty();
+        }
+
+        // Resumes each unfinished task at most once, starting after the last task which ran
+        // in the previous frame, and stops as soon as the budget is spent. Finished tasks are dropped.
+        void run_frame(std::chrono::microseconds budget) {
+            deadline = clock::now() + budget;
+            checkpoints_until_clock_read = checkpoints_per_clock_read;
+
+            size_t to_visit = tasks.size();
+            if (next >= tasks.size()) {
+                next = 0;
+            }
+
+            while (to_visit-- > 0 && !over_budget()) {
+                suspended_at = {};
+                tasks[next].resume_point.resume();
+
+                // The task may have called add(), so tasks can have reallocated during resume().
+                auto & entry = tasks[next];
+                if (entry.task.done()) {
+                    auto exception = entry.task.coroutine.promise().exception;
+                    tasks.erase(tasks.begin() + next);
+                    if (exception) {
+                        std::rethrow_exception(exception);
+                    }
+                }
+                else {
+                    entry.resume_point = suspended_at;
+                    ++next;
+                }
+
+                if (next >= tasks.size()) {
+                    next = 0;
+                }
+            }
+        }
+
+        bool over_budget() const noexcept {
+            return clock::now() >= deadline;
+        }
+
+        // Suspends until the next frame only if this frame's budget is spent. Most calls only count
+        // down to the next clock read, so it is cheap to co_await once per entity.
+        auto checkpoint() noexcept {
+            return suspension{ this, true };
+        }
+
+        // Always suspends until the next frame.
+        auto next_frame() noexcept {
+            return suspension{ this, false };
+        }
+
+    private:
+        struct suspension {
+            frame_scheduler * scheduler;
+            bool only_when_over_budget;
+
+            bool await_ready() const noexcept {
+                if (!only_when_over_budget) {
+                    return false;
+                }
+                if (--scheduler->checkpoints_until_clock_read != 0) {
+                    return true;
+                }
+
+                scheduler->checkpoints_until_clock_read = checkpoints_per_clock_read;
+                return !scheduler->over_budget();
+            }
+
+            void await_suspend(std::coroutine_handle<> h) noexcept {
+                scheduler->suspended_at = h;
+            }
+
+            void await_resume() const noexcept { }
+        };
+
+        struct entry {
+            system_task task;
+            std::coroutine_handle<> resume_point;
+        };
+
+        std::vector<entry> tasks;
+        size_t next = 0;
+        clock::time_point deadline;
+        unsigned checkpoints_until_clock_read = checkpoints_per_clock_read;
+        std::coroutine_handle<> suspended_at;
+    };
+}
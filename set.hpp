@@ -2,6 +2,8 @@
 
 #include <algorithm>
 #include <memory>
+#include <stdexcept>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -20,15 +22,109 @@ namespace jl {
     inline constexpr auto address_of = AddressGetter{};
 
     namespace containers {
-        template<class T>
+        // Deleter for elements obtained from a stateless allocator.
+        template<class Allocator>
+        struct allocator_delete {
+            template<class T>
+            void operator()(T * t) const {
+                Allocator allocator;
+                std::allocator_traits<Allocator>::destroy(allocator, t);
+                std::allocator_traits<Allocator>::deallocate(allocator, t, 1);
+            }
+        };
+
+        template<class T, class Allocator = std::allocator<T>>
         struct set {
+            // With the default allocator elements are plain std::unique_ptrs, as they always were.
+            using element_pointer = std::conditional_t<std::is_same_v<Allocator, std::allocator<T>>,
+                std::unique_ptr<T>,
+                std::unique_ptr<T, allocator_delete<Allocator>>>;
+
         private:
-            std::vector<std::unique_ptr<T>> dynamic_array;
+            std::vector<element_pointer> dynamic_array;
+            // False after sort_by(). Lookups then go through address_index, a list of
+            // (address, position in dynamic_array) pairs sorted by address, rebuilt lazily when stale.
+            bool ordered_by_address = true;
+            std::vector<std::pair<T *, size_t>> address_index;
+            bool address_index_stale = false;
+
+            static bool address_less(std::pair<T *, size_t> const & entry, T const * t) noexcept {
+                return entry.first < t;
+            }
+
+            auto index_entry_of(T const * t) {
+                if (address_index_stale) {
+                    address_index.clear();
+                    address_index.reserve(dynamic_array.size());
+                    for (size_t i = 0; i < dynamic_array.size(); ++i) {
+                        address_index.emplace_back(dynamic_array[i].get(), i);
+                    }
+                    std::sort(address_index.begin(), address_index.end());
+                    address_index_stale = false;
+                }
+
+                return std::lower_bound(address_index.begin(), address_index.end(), t, address_less);
+            }
+
+            size_t position_of(T const * t) {
+                auto entry = index_entry_of(t);
+                if (entry == address_index.end() || entry->first != t) {
+                    return dynamic_array.size();
+                }
+                return entry->second;
+            }
+
+            // In address order the vector is shifted to keep it sorted. In key order the last
+            // element is swapped into the hole instead, which disturbs the key order only until the
+            // next sort_by(). The address index still erases one entry, so removal shifts the
+            // index entries above it, which is linear but only moves pairs of plain values.
+            element_pointer take_out(size_t position) {
+                auto taken = std::move(dynamic_array[position]);
+
+                if (ordered_by_address) {
+                    dynamic_array.erase(dynamic_array.begin() + position);
+                    return taken;
+                }
+
+                size_t last = dynamic_array.size() - 1;
+                if (!address_index_stale) {
+                    if (position != last) {
+                        index_entry_of(dynamic_array[last].get())->second = position;
+                    }
+                    address_index.erase(index_entry_of(taken.get()));
+                }
+
+                if (position != last) {
+                    dynamic_array[position] = std::move(dynamic_array[last]);
+                }
+                dynamic_array.pop_back();
+
+                return taken;
+            }
 
 
         public:
-            using iterator = typename std::vector<std::unique_ptr<T>>::iterator;
-            using const_iterator = typename std::vector<std::unique_ptr<T>>::const_iterator;
+            using iterator = typename std::vector<element_pointer>::iterator;
+            using const_iterator = typename std::vector<element_pointer>::const_iterator;
+
+            template<class ... ConstructorArgs>
+            static element_pointer make_element(ConstructorArgs && ... arguments) {
+                if constexpr (std::is_same_v<Allocator, std::allocator<T>>) {
+                    return std::make_unique<T>(std::forward<ConstructorArgs>(arguments)...);
+                }
+                else {
+                    Allocator allocator;
+                    T * t = std::allocator_traits<Allocator>::allocate(allocator, 1);
+                    try {
+                        std::allocator_traits<Allocator>::construct(allocator, t, std::forward<ConstructorArgs>(arguments)...);
+                    }
+                    catch (...) {
+                        std::allocator_traits<Allocator>::deallocate(allocator, t, 1);
+                        throw;
+                    }
+                    return element_pointer(t);
+                }
+            }
 
             iterator begin() noexcept {
                 return dynamic_array.begin();
@@ -46,7 +142,11 @@ namespace jl {
                 return dynamic_array.end();
             }
 
-            iterator find(T * t) noexcept {
+            iterator find(T * t) {
+                if (!ordered_by_address) {
+                    return dynamic_array.begin() + position_of(t);
+                }
+
                 // Generic implementation of std::lower_bound
                 iterator first = dynamic_array.begin();
                 iterator it = first;
@@ -73,6 +173,10 @@ namespace jl {
             }
 
             const_iterator find(T const *t) {
+                if (!ordered_by_address) {
+                    return dynamic_array.cbegin() + position_of(t);
+                }
+
                 // Generic implementation of std::lower_bound
                 const_iterator first = dynamic_array.begin();
                 const_iterator last = dynamic_array.end();
@@ -127,15 +231,202 @@ namespace jl {
             }
 
             T * create_new() {
-                auto t = std::make_unique<T>();
-                auto it = find(t.get());
-                if ((it == dynamic_array.end()) || (it->get() < t.get())) {
+                auto t = make_element();
+
+                if (!ordered_by_address) {
+                    dynamic_array.push_back(std::move(t));
+                    auto * created = dynamic_array.back().get();
+                    if (!address_index_stale) {
+                        // Marked stale while inserting, so a throwing insert leads to a rebuild
+                        // instead of a missing entry.
+                        auto where = index_entry_of(created);
+                        address_index_stale = true;
+                        address_index.insert(where, { created, dynamic_array.size() - 1 });
+                        address_index_stale = false;
+                    }
+                    return created;
+                }
+
+                auto it = std::lower_bound(dynamic_array.begin(), dynamic_array.end(), t, [](auto const & lhs, auto const & rhs) {
+                    return lhs.get() < rhs.get();
+                });
+                if ((it == dynamic_array.end()) || (t.get() < it->get())) {
                     return dynamic_array.insert(it, std::move(t))->get();
                 }
 
                 throw std::runtime_error("lolwut");
             }
 
+            // Spawning many objects through create_new() costs a sorted insertion each, which is
+            // quadratic in the batch size. This allocates the whole batch first and merges it in once.
+            std::vector<T *> create_copies(T const & prototype, size_t count) {
+                std::vector<element_pointer> batch;
+                std::vector<T *> addresses;
+                batch.reserve(count);
+                addresses.reserve(count);
+
+                for (size_t i = 0; i < count; ++i) {
+                    batch.push_back(make_element(prototype));
+                    addresses.push_back(batch.back().get());
+                }
+
+                adopt(std::move(batch));
+                return addresses;
+            }
+
+            // Move-constructs one new element from each source, in order, and merges them in at once.
+            // The sources are left in the set in their moved-from state.
+            std::vector<T *> create_moved_from(std::vector<T *> const & sources) {
+                std::vector<element_pointer> batch;
+                std::vector<T *> addresses;
+                batch.reserve(sources.size());
+                addresses.reserve(sources.size());
+
+                for (auto * source : sources) {
+                    batch.push_back(make_element(std::move(*source)));
+                    addresses.push_back(batch.back().get());
+                }
+
+                adopt(std::move(batch));
+                return addresses;
+            }
+
+            void adopt(std::vector<element_pointer> && batch) {
+                auto by_address = [](auto const & lhs, auto const & rhs) {
+                    return lhs.get() < rhs.get();
+                };
+
+                std::sort(batch.begin(), batch.end(), by_address);
+
+                auto old_size = dynamic_array.size();
+                dynamic_array.reserve(old_size + batch.size());
+                dynamic_array.insert(dynamic_array.end(),
+                    std::make_move_iterator(batch.begin()),
+                    std::make_move_iterator(batch.end()));
+
+                if (ordered_by_address) {
+                    std::inplace_merge(dynamic_array.begin(), dynamic_array.begin() + old_size, dynamic_array.end(), by_address);
+                }
+                else if (!address_index_stale) {
+                    auto old_index_size = address_index.size();
+                    address_index_stale = true;
+                    for (size_t i = old_size; i < dynamic_array.size(); ++i) {
+                        address_index.emplace_back(dynamic_array[i].get(), i);
+                    }
+                    std::inplace_merge(address_index.begin(), address_index.begin() + old_index_size, address_index.end());
+                    address_index_stale = false;
+                }
+            }
+
+            // Destroys every element of the batch with one pass over the set.
+            void remove_all(std::vector<T *> batch) {
+                std::sort(batch.begin(), batch.end());
+
+                std::erase_if(dynamic_array, [&batch](auto const & up) {
+                    return std::binary_search(batch.begin(), batch.end(), up.get());
+                });
+
+                address_index_stale = !ordered_by_address;
+            }
+
+            // Like remove_all(), but hands the elements of the batch back instead of destroying them.
+            std::vector<element_pointer> release_all(std::vector<T *> batch) {
+                std::sort(batch.begin(), batch.end());
+
+                std::vector<element_pointer> released;
+                released.reserve(batch.size());
+
+                size_t kept = 0;
+                for (size_t i = 0; i < dynamic_array.size(); ++i) {
+                    if (std::binary_search(batch.begin(), batch.end(), dynamic_array[i].get())) {
+                        released.push_back(std::move(dynamic_array[i]));
+                    }
+                    else if (kept++ != i) {
+                        dynamic_array[kept - 1] = std::move(dynamic_array[i]);
+                    }
+                }
+                dynamic_array.resize(kept);
+
+                address_index_stale = !ordered_by_address;
+                return released;
+            }
+
+            // Reorders iteration by key_of(element), for example a Morton code of a position, so that
+            // elements used together are visited together. Elements themselves do not move, so
+            // pointers to them stay valid, and find() stays a binary search through the address
+            // index. Insertion sort is linear when the previous order is nearly right, which
+            // is the usual case when re-sorting every frame; heavily shuffled input falls back to
+            // std::sort. Elements created later are appended until the next sort_by().
+            // All keys are computed before anything moves, so a throwing key_of leaves the set as it was.
+            template<class KeyFunction>
+            void sort_by(KeyFunction key_of) {
+                using key_type = std::decay_t<decltype(key_of(std::declval<T const &>()))>;
+
+                std::vector<key_type> keys;
+                keys.reserve(dynamic_array.size());
+                for (auto const & up : dynamic_array) {
+                    keys.push_back(key_of(*up));
+                }
+
+                std::vector<size_t> order(dynamic_array.size());
+                for (size_t i = 0; i < order.size(); ++i) {
+                    order[i] = i;
+                }
+
+                auto by_key = [&keys](size_t lhs, size_t rhs) {
+                    return keys[lhs] < keys[rhs];
+                };
+
+                size_t shifts_left = 4 * order.size();
+                for (size_t i = 1; i < order.size() && shifts_left > 0; ++i) {
+                    for (size_t j = i; j > 0 && shifts_left > 0 && by_key(order[j], order[j - 1]); --j, --shifts_left) {
+                        std::swap(order[j], order[j - 1]);
+                    }
+                }
+
+                if (shifts_left == 0) {
+                    std::sort(order.begin(), order.end(), by_key);
+                }
+
+                std::vector<element_pointer> permuted;
+                permuted.reserve(dynamic_array.size());
+                std::vector<size_t> new_position(dynamic_array.size());
+                for (size_t i = 0; i < order.size(); ++i) {
+                    new_position[order[i]] = i;
+                }
+
+                if (ordered_by_address) {
+                    address_index.clear();
+                    address_index.reserve(dynamic_array.size());
+                    for (size_t i = 0; i < dynamic_array.size(); ++i) {
+                        address_index.emplace_back(dynamic_array[i].get(), new_position[i]);
+                    }
+                    address_index_stale = false;
+                }
+                else if (!address_index_stale) {
+                    for (auto & entry : address_index) {
+                        entry.second = new_position[entry.second];
+                    }
+                }
+
+                for (auto i : order) {
+                    permuted.push_back(std::move(dynamic_array[i]));
+                }
+                dynamic_array.swap(permuted);
+
+                ordered_by_address = false;
+            }
+
+            void sort_by_address() {
+                std::sort(dynamic_array.begin(), dynamic_array.end(), [](auto const & lhs, auto const & rhs) {
+                    return lhs.get() < rhs.get();
+                });
+
+                ordered_by_address = true;
+                address_index.clear();
+                address_index_stale = false;
+            }
+
             template<class ... ConstructorArgs>
             void emplace(ConstructorArgs && ... arguments) {
                 insert(std::make_unique<T>((static_cast<ConstructorArgs&&>(arguments), ...)));
@@ -163,25 +454,40 @@ namespace jl {
                 return dynamic_array.empty();
             }
 
+            size_t size() const noexcept {
+                return dynamic_array.size();
+            }
+
             void remove(iterator it) {
-                dynamic_array.erase(it);
+                take_out(it - dynamic_array.begin());
             }
 
             void remove(T * value) {
-                dynamic_array.erase(std::lower_bound(dynamic_array.begin(),
-                    dynamic_array.end(),
-                    std::make_unique<T>(nullptr),
-                    [](auto const &lhs, auto const &rhs){
-                        return lhs.get() < rhs.get();
-                    }));
+                auto itr = find(value);
+                if (itr != dynamic_array.end()) {
+                    remove(itr);
+                }
+            }
+
+            // Takes ownership of value away from the set without destroying it.
+            element_pointer release(T * value) {
+                auto itr = find(value);
+                if (itr == dynamic_array.end()) {
+                    return nullptr;
+                }
+
+                return take_out(itr - dynamic_array.begin());
             }
 
             void destroy_and_deallocate(T* value) {
-                auto itr = std::lower_bound();
+                remove(value);
             }
 
             void clear() noexcept(noexcept(std::declval<T>().~T())) {
                 dynamic_array.clear();
+                ordered_by_address = true;
+                address_index.clear();
+                address_index_stale = false;
             }
 
         };